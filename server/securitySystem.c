@@ -18,14 +18,113 @@
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <termios.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <poll.h>
 
 #define PORT 9000
 #define START_LEN 128
 #define CRTSCTS 020000000000
 #define DB_FILE "/var/lib/securitySystem/tagDB"
+#define NS_DIR "/var/lib/securitySystem/namespaces"
+#define NS_DB_NAME "tagDB"
+#define NS_READER_NAME "reader"
+#define DEFAULT_NS "default"
+#define DEFAULT_READER "/dev/ttyUSB0"
+#define NS_IDLE_SECS 300
+#define NS_EVICT_INTERVAL 60
+#define STORAGE_RETRY_SECS 5
+#define READER_POLL_MS 50
+#define TAG_LEN 12
+#define TIME_LEN 18
+
+enum storageOp
+{
+    STORAGE_APPEND,
+    STORAGE_REWRITE
+};
+
+struct storageRecord
+{
+    enum storageOp op;
+    char *data; // line to append, unused for rewrites
+    size_t len;
+    int status; // result of the last attempt
+    bool done;  // set once the record is durable
+    struct storageRecord *next;
+};
+
+struct dbStats
+{
+    unsigned long granted;
+    unsigned long denied;
+    unsigned long added;
+    unsigned long deleted;
+    unsigned long modified;
+    unsigned long flushes;
+    unsigned long flushFailures;
+    unsigned long evictions;
+};
+
+// One tag DB namespace. Data, index, queue and fd are guarded by storage.lock
+struct tagDB
+{
+    char name[NAME_MAX + 1];
+    char path[PATH_MAX];
+    char reader[PATH_MAX];
+    int serial_fd;
+    // DB and reader opened; clear means the tenant is offline. Only the main
+    // thread changes it, under storage.lock once the storage thread runs
+    bool available;
+    char *data; // heap copy of the DB file, or its mapping while evicted
+    size_t len;
+    size_t cap;
+    char (*ids)[TAG_LEN]; // sorted tag IDs; always resident, decides access
+    size_t idCount;
+    size_t idCap;
+    bool mapped;
+    bool wantResident; // asks the storage thread to page data back in
+    bool needsRewrite; // the file may hold a torn or stale write
+    time_t retryAt;    // earliest retry after a failed flush
+    time_t lastUsed;
+    int fd; // append fd, owned by the storage thread
+    struct storageRecord *head;
+    struct storageRecord *tail;
+    struct dbStats stats;
+    struct tagDB *next;
+};
+
+struct storageState
+{
+    pthread_mutex_t lock;
+    pthread_cond_t pending;
+    bool stopping;
+    pthread_t thread;
+};
 
 volatile sig_atomic_t exitRequested = 0;
-FILE *fp = NULL;
+static struct storageState storage = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .pending = PTHREAD_COND_INITIALIZER,
+};
+static struct tagDB *namespaces = NULL;
+static struct pollfd *readerFds = NULL; // one entry per distinct reader
+static nfds_t readerCount = 0;
+
+// Client replies waiting on a storage record; only touched by the main thread
+struct pendingReply
+{
+    struct storageRecord *rec;
+    int conn_fd;
+    const char *okMsg;
+    const char *failMsg;
+    bool warned;
+    bool warnNow;
+    struct pendingReply *next;
+};
+
+static struct pendingReply *pendingReplies = NULL;
 
 static void sigint_handler(int signo)
 {
@@ -71,229 +170,1458 @@ int readFromSocket(int conn_fd, char *buffer, int buflen)
         }
         else if (len_recv == 0)
         {
-            return -2;
+            return -2;
+        }
+        else
+        {
+            pos += len_recv;
+        }
+        *(buffer + (buflen - 1)) = 0;
+    } while (strchr(buffer, '\n') == NULL);
+    return buflen;
+}
+
+int readBytesFromSerial(const int fd, void *const buffer, size_t const bytes)
+{
+    char *head = (char *)buffer;
+    char *const tail = (char *)buffer + bytes;
+    int saved_errno;
+    ssize_t n;
+    int ret_bytes = 0;
+
+    saved_errno = errno;
+
+    do
+    {
+        n = read(fd, head, (size_t)(tail - head));
+        if (n > (ssize_t)0)
+            head += n;
+        ret_bytes += (int)n;
+    } while (n > 0 && head < tail);
+
+    errno = saved_errno;
+    return ret_bytes;
+}
+
+static void formatCurrentTime(char *time_str)
+{
+    time_t t;
+    struct tm *wallTime;
+
+    memset(time_str, 0, TIME_LEN);
+    t = time(NULL);
+    wallTime = localtime(&t);
+    strftime(time_str, TIME_LEN, "%x %X", wallTime);
+    time_str[TIME_LEN - 1] = '\n';
+}
+
+/*
+ * Storage stage. Each namespace's tag DB lives in memory and all lookups are
+ * served from there; mutations are applied in memory and queued as records
+ * for the storage thread, which writes them out in order and fdatasyncs once
+ * per batch. The main thread never waits on a record: it keeps serving
+ * scans and sends the client's reply once the record is marked done.
+ *
+ * Namespaces left idle for NS_IDLE_SECS drop the heap copy of their DB text
+ * and fall back to a read-only mapping of the file, so the kernel can reclaim
+ * the pages. The tag index stays resident, so access decisions never wait on
+ * the file; the storage thread copies the text back when it is next needed.
+ */
+static int writeAll(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        n = write(fd, buf, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int syncParentDir(const char *path)
+{
+    char dir[PATH_MAX];
+    char *slash;
+    int dir_fd, ret;
+
+    snprintf(dir, sizeof(dir), "%s", path);
+    slash = strrchr(dir, '/');
+    if (slash == NULL)
+    {
+        return 0;
+    }
+    *slash = 0;
+    dir_fd = open(dir[0] ? dir : "/", O_RDONLY | O_DIRECTORY);
+    if (dir_fd < 0)
+    {
+        return -1;
+    }
+    ret = fsync(dir_fd);
+    close(dir_fd);
+    return ret;
+}
+
+static int storageAppend(struct tagDB *ns, struct storageRecord *batch)
+{
+    struct storageRecord *rec;
+
+    if (ns->fd < 0)
+    {
+        ns->fd = open(ns->path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+        if (ns->fd < 0)
+        {
+            perror("open");
+            return -1;
+        }
+    }
+    for (rec = batch; rec != NULL; rec = rec->next)
+    {
+        if (writeAll(ns->fd, rec->data, rec->len) != 0)
+        {
+            perror("write");
+            break;
+        }
+    }
+    if (rec == NULL && fdatasync(ns->fd) == 0)
+    {
+        return 0;
+    }
+    // Part of the batch may be on disk; the caller rewrites from memory
+    close(ns->fd);
+    ns->fd = -1;
+    return -1;
+}
+
+static int storageRewrite(struct tagDB *ns, const char *buf, size_t len)
+{
+    char tmpPath[PATH_MAX + 4];
+    int tmp_fd;
+
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", ns->path);
+    tmp_fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (tmp_fd < 0)
+    {
+        perror("open");
+        return -1;
+    }
+    if (writeAll(tmp_fd, buf, len) != 0 || fdatasync(tmp_fd) != 0)
+    {
+        perror("write");
+        close(tmp_fd);
+        unlink(tmpPath);
+        return -1;
+    }
+    close(tmp_fd);
+
+    if (rename(tmpPath, ns->path) != 0)
+    {
+        perror("rename");
+        unlink(tmpPath);
+        return -1;
+    }
+    // The append fd still points at the replaced file
+    if (ns->fd >= 0)
+    {
+        close(ns->fd);
+        ns->fd = -1;
+    }
+    return syncParentDir(ns->path);
+}
+
+// Maps path read-only; an empty file gives a NULL map
+static bool mapFile(const char *path, char **map, size_t *len)
+{
+    struct stat st;
+    void *addr;
+    int map_fd;
+
+    map_fd = open(path, O_RDONLY | O_CREAT, 0644);
+    if (map_fd < 0)
+    {
+        perror("open");
+        return false;
+    }
+    if (fstat(map_fd, &st) != 0)
+    {
+        perror("fstat");
+        close(map_fd);
+        return false;
+    }
+
+    addr = NULL;
+    if (st.st_size > 0)
+    {
+        addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, map_fd, 0);
+        if (addr == MAP_FAILED)
+        {
+            perror("mmap");
+            close(map_fd);
+            return false;
+        }
+    }
+    close(map_fd);
+
+    *map = (char *)addr;
+    *len = (size_t)st.st_size;
+    return true;
+}
+
+static char *copyToHeap(const char *map, size_t len, size_t *cap)
+{
+    char *heap;
+
+    *cap = len + START_LEN;
+    heap = (char *)malloc(*cap);
+    if (heap == NULL)
+    {
+        perror("malloc");
+        return NULL;
+    }
+    if (len > 0)
+    {
+        memcpy(heap, map, len);
+    }
+    heap[len] = 0;
+    return heap;
+}
+
+/*
+ * Must be called from the storage thread with storage.lock held; drops it
+ * while copying so faulting the mapping in never blocks lookups. Only this
+ * thread changes a namespace between mapped and resident.
+ */
+static void pageIn(struct tagDB *ns)
+{
+    char *map = ns->data, *heap;
+    size_t len = ns->len, cap;
+
+    ns->wantResident = false;
+    pthread_mutex_unlock(&storage.lock);
+    heap = copyToHeap(map, len, &cap);
+    pthread_mutex_lock(&storage.lock);
+    if (heap == NULL)
+    {
+        return;
+    }
+
+    ns->data = heap;
+    ns->cap = cap;
+    ns->mapped = false;
+    ns->lastUsed = time(NULL);
+    if (map != NULL)
+    {
+        munmap(map, len);
+    }
+}
+
+// The file only matches memory once nothing is queued or owed
+static bool canEvict(struct tagDB *ns, time_t now)
+{
+    return ns->available && !ns->mapped && !ns->needsRewrite && ns->head == NULL &&
+           now - ns->lastUsed >= NS_IDLE_SECS;
+}
+
+// Must be called with storage.lock held; drops it while mapping files
+static void evictIdle()
+{
+    struct tagDB *ns;
+    char *map;
+    size_t len;
+    bool mapped;
+
+    for (ns = namespaces; ns != NULL; ns = ns->next)
+    {
+        if (!canEvict(ns, time(NULL)))
+        {
+            continue;
+        }
+        pthread_mutex_unlock(&storage.lock);
+        mapped = mapFile(ns->path, &map, &len);
+        pthread_mutex_lock(&storage.lock);
+        if (!mapped)
+        {
+            continue;
+        }
+
+        // Anything written meanwhile means the mapping is already stale
+        if (!canEvict(ns, time(NULL)) || len != ns->len)
+        {
+            if (map != NULL)
+            {
+                munmap(map, len);
+            }
+            continue;
+        }
+        free(ns->data);
+        ns->data = map;
+        ns->cap = 0;
+        ns->mapped = true;
+        if (ns->fd >= 0)
+        {
+            close(ns->fd);
+            ns->fd = -1;
+        }
+        ns->stats.evictions++;
+        syslog(LOG_DEBUG, "Evicted idle namespace %s", ns->name);
+    }
+}
+
+// Must be called with storage.lock held; drops it while writing
+static void flushNamespace(struct tagDB *ns)
+{
+    struct storageRecord *batch, *rec, *last;
+    char *snapshot;
+    size_t snapshotLen;
+    bool rewrite;
+    int status;
+
+    // Everything queued while the last batch was in flight goes out together
+    batch = ns->head;
+    ns->head = NULL;
+    ns->tail = NULL;
+
+    rewrite = ns->needsRewrite;
+    for (rec = last = batch; rec != NULL; last = rec, rec = rec->next)
+    {
+        if (rec->op == STORAGE_REWRITE)
+        {
+            rewrite = true;
+        }
+    }
+
+    // A rewrite supersedes the appends in the same batch, and the
+    // snapshot taken here reflects exactly the records in it. After a
+    // failed flush the file can't be appended to until it is rewritten
+    snapshot = NULL;
+    snapshotLen = 0;
+    if (rewrite)
+    {
+        snapshotLen = ns->len;
+        snapshot = (char *)malloc(snapshotLen + 1);
+        if (snapshot != NULL)
+        {
+            memcpy(snapshot, ns->data, snapshotLen);
+        }
+    }
+    pthread_mutex_unlock(&storage.lock);
+
+    if (rewrite)
+    {
+        status = snapshot ? storageRewrite(ns, snapshot, snapshotLen) : -1;
+    }
+    else
+    {
+        status = storageAppend(ns, batch);
+    }
+    free(snapshot);
+    if (status != 0)
+    {
+        syslog(LOG_ERR, "Failed to persist namespace %s to %s", ns->name, ns->path);
+    }
+
+    pthread_mutex_lock(&storage.lock);
+    if (status != 0)
+    {
+        ns->needsRewrite = true;
+    }
+    else if (rewrite)
+    {
+        ns->needsRewrite = false;
+    }
+    ns->stats.flushes++;
+    for (rec = batch; rec != NULL; rec = rec->next)
+    {
+        rec->status = status;
+        rec->done = status == 0;
+    }
+    if (status != 0)
+    {
+        // The change stays live in memory; keep its records queued ahead
+        // of anything newer and retry until they reach the disk
+        ns->stats.flushFailures++;
+        ns->retryAt = time(NULL) + STORAGE_RETRY_SECS;
+        last->next = ns->head;
+        if (ns->head == NULL)
+        {
+            ns->tail = last;
+        }
+        ns->head = batch;
+    }
+}
+
+static void *storageThread(void *arg)
+{
+    struct tagDB *ns;
+    struct timespec deadline;
+    time_t lastScan, now;
+    bool worked, retrying, finalAttempt = false;
+
+    pthread_mutex_lock(&storage.lock);
+    lastScan = time(NULL);
+    while (true)
+    {
+        worked = false;
+        retrying = false;
+        now = time(NULL);
+        for (ns = namespaces; ns != NULL; ns = ns->next)
+        {
+            if (ns->wantResident && ns->mapped)
+            {
+                pageIn(ns);
+                worked = true;
+            }
+            if (ns->head != NULL && ns->retryAt > now)
+            {
+                retrying = true;
+            }
+            else if (ns->head != NULL)
+            {
+                flushNamespace(ns);
+                worked = true;
+            }
+        }
+        if (worked)
+        {
+            continue;
+        }
+        if (storage.stopping)
+        {
+            // Don't let the retry timer cost a last chance to save
+            for (ns = namespaces; ns != NULL; ns = ns->next)
+            {
+                if (ns->head != NULL && !finalAttempt)
+                {
+                    flushNamespace(ns);
+                }
+                if (ns->head != NULL)
+                {
+                    syslog(LOG_ERR, "Exiting with unsaved changes in namespace %s", ns->name);
+                }
+            }
+            if (!finalAttempt)
+            {
+                finalAttempt = true;
+                continue;
+            }
+            break;
+        }
+
+        if (time(NULL) - lastScan >= NS_EVICT_INTERVAL)
+        {
+            evictIdle();
+            lastScan = time(NULL);
+        }
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += retrying ? STORAGE_RETRY_SECS : NS_EVICT_INTERVAL;
+        pthread_cond_timedwait(&storage.pending, &storage.lock, &deadline);
+    }
+    pthread_mutex_unlock(&storage.lock);
+
+    for (ns = namespaces; ns != NULL; ns = ns->next)
+    {
+        if (ns->fd >= 0)
+        {
+            close(ns->fd);
+            ns->fd = -1;
+        }
+    }
+    return NULL;
+}
+
+// Must be called with storage.lock held
+static void storageQueue(struct tagDB *ns, struct storageRecord *rec)
+{
+    rec->next = NULL;
+    rec->done = false;
+    rec->status = 0;
+    if (ns->tail != NULL)
+    {
+        ns->tail->next = rec;
+    }
+    else
+    {
+        ns->head = rec;
+    }
+    ns->tail = rec;
+    pthread_cond_signal(&storage.pending);
+}
+
+// Must be called with storage.lock held on a resident namespace
+static bool reserveDB(struct tagDB *ns, size_t extra)
+{
+    char *temp;
+    size_t cap;
+
+    if (ns->len + extra + 1 <= ns->cap)
+    {
+        return true;
+    }
+    cap = ns->cap ? ns->cap : START_LEN;
+    while (cap < ns->len + extra + 1)
+    {
+        cap *= 2;
+    }
+    temp = (char *)realloc(ns->data, cap);
+    if (temp == NULL)
+    {
+        perror("realloc");
+        return false;
+    }
+    ns->data = temp;
+    ns->cap = cap;
+    return true;
+}
+
+static int compareTags(const void *a, const void *b)
+{
+    return memcmp(a, b, TAG_LEN);
+}
+
+// Must be called with storage.lock held; *slot is where tag is or would go
+static bool indexFind(struct tagDB *ns, const char *tag, size_t *slot)
+{
+    size_t lo = 0, hi = ns->idCount, mid;
+    int cmp;
+
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        cmp = memcmp(ns->ids[mid], tag, TAG_LEN);
+        if (cmp == 0)
+        {
+            *slot = mid;
+            return true;
+        }
+        if (cmp < 0)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    *slot = lo;
+    return false;
+}
+
+static bool reserveIndex(struct tagDB *ns, size_t extra)
+{
+    char(*temp)[TAG_LEN];
+    size_t cap;
+
+    if (ns->idCount + extra <= ns->idCap)
+    {
+        return true;
+    }
+    cap = ns->idCap ? ns->idCap : START_LEN;
+    while (cap < ns->idCount + extra)
+    {
+        cap *= 2;
+    }
+    temp = (char(*)[TAG_LEN])realloc(ns->ids, cap * TAG_LEN);
+    if (temp == NULL)
+    {
+        perror("realloc");
+        return false;
+    }
+    ns->ids = temp;
+    ns->idCap = cap;
+    return true;
+}
+
+// Must be called with storage.lock held and room reserved
+static void indexInsert(struct tagDB *ns, const char *tag, size_t slot)
+{
+    memmove(ns->ids[slot + 1], ns->ids[slot], (ns->idCount - slot) * TAG_LEN);
+    memcpy(ns->ids[slot], tag, TAG_LEN);
+    ns->idCount++;
+}
+
+// Must be called with storage.lock held
+static void indexRemove(struct tagDB *ns, size_t slot)
+{
+    ns->idCount--;
+    memmove(ns->ids[slot], ns->ids[slot + 1], (ns->idCount - slot) * TAG_LEN);
+}
+
+static bool buildIndex(struct tagDB *ns)
+{
+    char *pos = ns->data;
+    char *tail = ns->data + ns->len;
+    char *nextPos;
+    size_t lines = 0, i, kept;
+
+    for (nextPos = pos; (nextPos = memchr(nextPos, '\n', (size_t)(tail - nextPos))) != NULL; nextPos++)
+    {
+        lines++;
+    }
+    ns->idCount = 0;
+    if (!reserveIndex(ns, lines + 1))
+    {
+        return false;
+    }
+
+    while (pos != NULL && pos + TAG_LEN <= tail)
+    {
+        memcpy(ns->ids[ns->idCount++], pos, TAG_LEN);
+        nextPos = memchr(pos, '\n', (size_t)(tail - pos));
+        if (nextPos == NULL)
+        {
+            break;
+        }
+        pos = nextPos + 1;
+    }
+
+    qsort(ns->ids, ns->idCount, TAG_LEN, compareTags);
+    for (i = 1, kept = ns->idCount ? 1 : 0; i < ns->idCount; i++)
+    {
+        if (memcmp(ns->ids[i], ns->ids[kept - 1], TAG_LEN) != 0)
+        {
+            memcpy(ns->ids[kept++], ns->ids[i], TAG_LEN);
+        }
+    }
+    ns->idCount = kept;
+    return true;
+}
+
+static bool addNamespace(const char *name, const char *path, const char *reader)
+{
+    struct tagDB *ns, **tail;
+    char *map;
+
+    ns = (struct tagDB *)calloc(1, sizeof(*ns));
+    if (ns == NULL)
+    {
+        perror("calloc");
+        return false;
+    }
+    snprintf(ns->name, sizeof(ns->name), "%s", name);
+    snprintf(ns->path, sizeof(ns->path), "%s", path);
+    snprintf(ns->reader, sizeof(ns->reader), "%s", reader);
+    ns->serial_fd = -1;
+    ns->fd = -1;
+
+    ns->lastUsed = time(NULL);
+
+    // A tenant whose DB can't be read stays listed but offline
+    if (mapFile(ns->path, &map, &ns->len))
+    {
+        ns->data = copyToHeap(map, ns->len, &ns->cap);
+        if (map != NULL)
+        {
+            munmap(map, ns->len);
+        }
+    }
+    ns->available = ns->data != NULL && buildIndex(ns);
+    if (!ns->available)
+    {
+        free(ns->data);
+        ns->data = NULL;
+        ns->len = 0;
+        ns->cap = 0;
+        ns->idCount = 0;
+        syslog(LOG_ERR, "Namespace %s unavailable: cannot load %s", ns->name, ns->path);
+    }
+    else if (ns->reader[0] == 0)
+    {
+        // Falling back to a default device could open another tenant's door
+        ns->available = false;
+        syslog(LOG_ERR, "Namespace %s unavailable: no %s file", ns->name, NS_READER_NAME);
+    }
+
+    for (tail = &namespaces; *tail != NULL; tail = &(*tail)->next)
+        ;
+    *tail = ns;
+    return true;
+}
+
+// Leaves reader empty if the namespace doesn't name one
+static void readReaderFile(const char *nsDir, char *reader, size_t readerLen)
+{
+    char path[PATH_MAX + NAME_MAX + 2];
+    FILE *readerFp;
+
+    reader[0] = 0;
+    snprintf(path, sizeof(path), "%s/%s", nsDir, NS_READER_NAME);
+    readerFp = fopen(path, "r");
+    if (!readerFp)
+    {
+        return;
+    }
+    if (fgets(reader, (int)readerLen, readerFp) == NULL)
+    {
+        reader[0] = 0;
+    }
+    reader[strcspn(reader, "\r\n")] = 0;
+    fclose(readerFp);
+}
+
+/*
+ * Every directory under NS_DIR is a namespace holding its own tagDB and a
+ * "reader" file naming its serial device; one without a reader stays
+ * offline. Without NS_DIR the daemon serves a single default namespace from
+ * DB_FILE on DEFAULT_READER.
+ */
+bool loadNamespaces()
+{
+    DIR *dir;
+    struct dirent *entry;
+    struct stat st;
+    char nsDir[PATH_MAX];
+    char path[PATH_MAX + NAME_MAX + 2];
+    char reader[PATH_MAX];
+    bool ret = true;
+
+    dir = opendir(NS_DIR);
+    if (dir == NULL)
+    {
+        if (errno != ENOENT)
+        {
+            perror("opendir");
+            return false;
+        }
+        return addNamespace(DEFAULT_NS, DB_FILE, DEFAULT_READER);
+    }
+
+    while (ret && (entry = readdir(dir)) != NULL)
+    {
+        if (entry->d_name[0] == '.')
+        {
+            continue;
+        }
+        snprintf(nsDir, sizeof(nsDir), "%s/%s", NS_DIR, entry->d_name);
+        if (stat(nsDir, &st) != 0 || !S_ISDIR(st.st_mode))
+        {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", nsDir, NS_DB_NAME);
+        readReaderFile(nsDir, reader, sizeof(reader));
+        ret = addNamespace(entry->d_name, path, reader);
+    }
+    closedir(dir);
+
+    if (ret && namespaces == NULL)
+    {
+        printf("No namespaces found in %s\n", NS_DIR);
+        return false;
+    }
+    return ret;
+}
+
+struct tagDB *findNamespace(const char *name)
+{
+    struct tagDB *ns;
+
+    for (ns = namespaces; ns != NULL; ns = ns->next)
+    {
+        if (strcmp(ns->name, name) == 0)
+        {
+            return ns;
+        }
+    }
+    return NULL;
+}
+
+struct tagDB *defaultNamespace()
+{
+    struct tagDB *ns = findNamespace(DEFAULT_NS);
+
+    if (ns != NULL && ns->available)
+    {
+        return ns;
+    }
+    for (ns = namespaces; ns != NULL; ns = ns->next)
+    {
+        if (ns->available)
+        {
+            return ns;
+        }
+    }
+    return NULL;
+}
+
+bool startStorage()
+{
+    if (pthread_create(&storage.thread, NULL, storageThread, NULL) != 0)
+    {
+        perror("pthread_create");
+        return false;
+    }
+    return true;
+}
+
+void stopStorage()
+{
+    pthread_mutex_lock(&storage.lock);
+    storage.stopping = true;
+    pthread_cond_signal(&storage.pending);
+    pthread_mutex_unlock(&storage.lock);
+    pthread_join(storage.thread, NULL);
+}
+
+// Asks the storage thread to page the DB text back in; never blocks
+void requestResident(struct tagDB *ns)
+{
+    pthread_mutex_lock(&storage.lock);
+    ns->lastUsed = time(NULL);
+    if (ns->mapped && !ns->wantResident)
+    {
+        ns->wantResident = true;
+        pthread_cond_signal(&storage.pending);
+    }
+    pthread_mutex_unlock(&storage.lock);
+}
+
+bool isResident(struct tagDB *ns)
+{
+    bool resident;
+
+    pthread_mutex_lock(&storage.lock);
+    resident = !ns->mapped;
+    pthread_mutex_unlock(&storage.lock);
+    return resident;
+}
+
+// Must be called with storage.lock held on a resident namespace
+static char *findTag(struct tagDB *ns, const char *tagToCheck)
+{
+    char *pos = ns->data;
+    char *tail = ns->data + ns->len;
+    char *nextPos;
+
+    while (pos != NULL && pos + TAG_LEN <= tail)
+    {
+        if (memcmp(pos, tagToCheck, TAG_LEN) == 0)
+        {
+            return pos;
+        }
+        nextPos = memchr(pos, '\n', (size_t)(tail - pos));
+        if (nextPos == NULL)
+        {
+            break;
+        }
+        pos = nextPos + 1;
+    }
+    return NULL;
+}
+
+// Must be called with storage.lock held; returns the length of the removed line
+static size_t removeLine(struct tagDB *ns, char *pos)
+{
+    char *tail = ns->data + ns->len;
+    char *nextPos = memchr(pos, '\n', (size_t)(tail - pos));
+    size_t lineLen = nextPos ? (size_t)(nextPos - pos + 1) : (size_t)(tail - pos);
+
+    memmove(pos, pos + lineLen, (size_t)(tail - pos) - lineLen);
+    ns->len -= lineLen;
+    ns->data[ns->len] = 0;
+    return lineLen;
+}
+
+// Must be called with storage.lock held; newData is "<name>," as sent by the client
+static char *appendLine(struct tagDB *ns, const char *tag, const char *newData, size_t *lineLen)
+{
+    char *line;
+    size_t dataLen = strlen(newData);
+
+    *lineLen = TAG_LEN + 1 + dataLen + TIME_LEN;
+    if (!reserveDB(ns, *lineLen))
+    {
+        return NULL;
+    }
+    line = ns->data + ns->len;
+    memcpy(line, tag, TAG_LEN);
+    line[TAG_LEN] = ',';
+    memcpy(line + TAG_LEN + 1, newData, dataLen);
+    formatCurrentTime(line + TAG_LEN + 1 + dataLen);
+    ns->len += *lineLen;
+    ns->data[ns->len] = 0;
+    return line;
+}
+
+/*
+ * Decides access from the tag index alone. If details is given and the tag
+ * is known, it gets a malloc'd copy of the tag's DB line, or NULL while the
+ * namespace is evicted; the text is then paged back in for next time.
+ */
+bool verifyAccess(struct tagDB *ns, char *tagToCheck, char **details)
+{
+    char *pos, *nextPos;
+    size_t retSize, slot;
+    bool granted;
+
+    pthread_mutex_lock(&storage.lock);
+    ns->lastUsed = time(NULL);
+    granted = indexFind(ns, tagToCheck, &slot);
+    if (granted && details != NULL)
+    {
+        *details = NULL;
+        pos = ns->mapped ? NULL : findTag(ns, tagToCheck);
+        if (pos != NULL)
+        {
+            nextPos = strchr(pos, '\n');
+            retSize = nextPos ? (size_t)(nextPos - pos + 1) : strlen(pos);
+            *details = (char *)malloc(retSize + 1);
+            if (*details != NULL)
+            {
+                memcpy(*details, pos, retSize);
+                (*details)[retSize] = 0;
+            }
+        }
+        else if (ns->mapped && !ns->wantResident)
+        {
+            ns->wantResident = true;
+            pthread_cond_signal(&storage.pending);
+        }
+    }
+    pthread_mutex_unlock(&storage.lock);
+    return granted;
+}
+
+// Mutations need the DB text; callers page it in with requestResident() first
+struct storageRecord *addTag(struct tagDB *ns, char *tagToAdd, char *newData)
+{
+    struct storageRecord *rec;
+    char *line;
+    size_t slot;
+
+    rec = (struct storageRecord *)calloc(1, sizeof(*rec));
+    if (rec == NULL)
+    {
+        perror("calloc");
+        return NULL;
+    }
+
+    pthread_mutex_lock(&storage.lock);
+    ns->lastUsed = time(NULL);
+    if (ns->mapped || indexFind(ns, tagToAdd, &slot) || !reserveIndex(ns, 1) ||
+        (line = appendLine(ns, tagToAdd, newData, &rec->len)) == NULL)
+    {
+        pthread_mutex_unlock(&storage.lock);
+        free(rec);
+        return NULL;
+    }
+    rec->op = STORAGE_APPEND;
+    rec->data = (char *)malloc(rec->len);
+    if (rec->data == NULL)
+    {
+        // Fall back to rewriting the whole file
+        rec->op = STORAGE_REWRITE;
+        rec->len = 0;
+    }
+    else
+    {
+        memcpy(rec->data, line, rec->len);
+    }
+    indexInsert(ns, tagToAdd, slot);
+    storageQueue(ns, rec);
+    ns->stats.added++;
+    pthread_mutex_unlock(&storage.lock);
+    return rec;
+}
+
+struct storageRecord *deleteTag(struct tagDB *ns, char *tagToCheck)
+{
+    struct storageRecord *rec;
+    char *pos;
+    size_t slot;
+
+    rec = (struct storageRecord *)calloc(1, sizeof(*rec));
+    if (rec == NULL)
+    {
+        perror("calloc");
+        return NULL;
+    }
+
+    pthread_mutex_lock(&storage.lock);
+    ns->lastUsed = time(NULL);
+    if (ns->mapped || !indexFind(ns, tagToCheck, &slot) || (pos = findTag(ns, tagToCheck)) == NULL)
+    {
+        pthread_mutex_unlock(&storage.lock);
+        free(rec);
+        return NULL;
+    }
+    removeLine(ns, pos);
+    indexRemove(ns, slot);
+
+    rec->op = STORAGE_REWRITE;
+    storageQueue(ns, rec);
+    ns->stats.deleted++;
+    pthread_mutex_unlock(&storage.lock);
+    return rec;
+}
+
+struct storageRecord *modifyTag(struct tagDB *ns, char *tagToCheck, char *newData)
+{
+    struct storageRecord *rec;
+    char tagBuf[TAG_LEN];
+    char *pos;
+
+    rec = (struct storageRecord *)calloc(1, sizeof(*rec));
+    if (rec == NULL)
+    {
+        perror("calloc");
+        return NULL;
+    }
+
+    pthread_mutex_lock(&storage.lock);
+    ns->lastUsed = time(NULL);
+    // Make room first so a failed append can't lose the old line
+    if (ns->mapped || findTag(ns, tagToCheck) == NULL ||
+        !reserveDB(ns, TAG_LEN + 1 + strlen(newData) + TIME_LEN))
+    {
+        pthread_mutex_unlock(&storage.lock);
+        free(rec);
+        return NULL;
+    }
+    pos = findTag(ns, tagToCheck);
+    memcpy(tagBuf, pos, TAG_LEN);
+    removeLine(ns, pos);
+    appendLine(ns, tagBuf, newData, &rec->len);
+
+    rec->op = STORAGE_REWRITE;
+    rec->len = 0;
+    storageQueue(ns, rec);
+    ns->stats.modified++;
+    pthread_mutex_unlock(&storage.lock);
+    return rec;
+}
+
+/*
+ * Sends okMsg to the client once rec is durable. A NULL rec means the change
+ * was rejected before being queued and failMsg is sent straight away. If a
+ * write fails the change stays in force and is retried, and the client is
+ * told so once.
+ */
+void deferReply(struct storageRecord *rec, int conn_fd, const char *okMsg, const char *failMsg)
+{
+    struct pendingReply *reply;
+
+    if (rec == NULL)
+    {
+        write(conn_fd, failMsg, strlen(failMsg));
+        return;
+    }
+    reply = (struct pendingReply *)malloc(sizeof(*reply));
+    if (reply == NULL)
+    {
+        // Leak the record rather than free it under the storage thread
+        perror("malloc");
+        return;
+    }
+    reply->rec = rec;
+    reply->conn_fd = conn_fd;
+    reply->okMsg = okMsg;
+    reply->failMsg = failMsg;
+    reply->warned = false;
+    reply->warnNow = false;
+    reply->next = pendingReplies;
+    pendingReplies = reply;
+}
+
+void sendCompletedReplies()
+{
+    struct pendingReply **link, *reply, *done = NULL;
+    const char warnMsg[] = "Change is active but could not be saved yet. Retrying.\n";
+
+    if (pendingReplies == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&storage.lock);
+    link = &pendingReplies;
+    while ((reply = *link) != NULL)
+    {
+        if (reply->rec->done)
+        {
+            *link = reply->next;
+            reply->next = done;
+            done = reply;
+        }
+        else
+        {
+            if (reply->rec->status != 0 && !reply->warned)
+            {
+                reply->warned = true;
+                reply->warnNow = true;
+            }
+            link = &reply->next;
+        }
+    }
+    pthread_mutex_unlock(&storage.lock);
+
+    for (reply = pendingReplies; reply != NULL; reply = reply->next)
+    {
+        if (reply->warnNow)
+        {
+            reply->warnNow = false;
+            if (reply->conn_fd >= 0)
+            {
+                write(reply->conn_fd, warnMsg, strlen(warnMsg));
+            }
         }
-        else
+    }
+
+    while ((reply = done) != NULL)
+    {
+        done = reply->next;
+        if (reply->conn_fd >= 0)
         {
-            pos += len_recv;
+            write(reply->conn_fd, reply->okMsg, strlen(reply->okMsg));
         }
-        *(buffer + (buflen - 1)) = 0;
-    } while (strchr(buffer, '\n') == NULL);
-    return buflen;
+        free(reply->rec->data);
+        free(reply->rec);
+        free(reply);
+    }
 }
 
-int readBytesFromSerial(const int fd, void *const buffer, size_t const bytes)
+// The client went away; its records still complete but nobody is told
+void dropReplies(int conn_fd)
 {
-    char *head = (char *)buffer;
-    char *const tail = (char *)buffer + bytes;
-    int saved_errno;
-    ssize_t n;
-    int ret_bytes = 0;
-
-    saved_errno = errno;
+    struct pendingReply *reply;
 
-    do
+    for (reply = pendingReplies; reply != NULL; reply = reply->next)
     {
-        n = read(fd, head, (size_t)(tail - head));
-        if (n > (ssize_t)0)
-            head += n;
-        ret_bytes += (int)n;
-    } while (n > 0 && head < tail);
-
-    errno = saved_errno;
-    return ret_bytes;
+        if (reply->conn_fd == conn_fd)
+        {
+            reply->conn_fd = -1;
+        }
+    }
 }
 
-void writeCurrentTime()
+int formatStats(struct tagDB *ns, char *buf, size_t buflen)
 {
-    char time_str[18];
-    time_t t;
-    struct tm *wallTime;
+    struct dbStats stats;
+    size_t len, tags;
+    bool mapped;
 
-    memset(time_str, 0, sizeof(time_str));
-    t = time(NULL);
-    wallTime = localtime(&t);
-    strftime(time_str, sizeof(time_str), "%x %X", wallTime);
-    time_str[17] = '\n';
-    fwrite(time_str, sizeof(char), 18, fp);
+    pthread_mutex_lock(&storage.lock);
+    stats = ns->stats;
+    len = ns->len;
+    tags = ns->idCount;
+    mapped = ns->mapped;
+    pthread_mutex_unlock(&storage.lock);
+
+    return snprintf(buf, buflen,
+                    "Namespace: %s (%s)\nReader: %s\nTags: %zu\nSize: %zu bytes (%s)\n"
+                    "Granted: %lu\nDenied: %lu\nAdded: %lu\nDeleted: %lu\nModified: %lu\n"
+                    "Flushes: %lu\nFlush failures: %lu\nEvictions: %lu\n",
+                    ns->name, ns->available ? "online" : "offline", ns->reader[0] ? ns->reader : "none", tags, len, mapped ? "evicted" : "resident",
+                    stats.granted, stats.denied, stats.added, stats.deleted, stats.modified,
+                    stats.flushes, stats.flushFailures, stats.evictions);
 }
 
-char *verifyAccess(char *tagToCheck)
+void countScan(struct tagDB *ns, bool granted)
 {
-    long fileSize;
-    char *fileBuf = NULL;
-    char tagBuf[13];
-    char *tail, *pos, *retBuf, *nextPos;
-    size_t retSize;
+    pthread_mutex_lock(&storage.lock);
+    if (granted)
+    {
+        ns->stats.granted++;
+    }
+    else
+    {
+        ns->stats.denied++;
+    }
+    pthread_mutex_unlock(&storage.lock);
+}
 
-    memset(tagBuf, 0, sizeof(tagBuf));
+int openReader(const char *device)
+{
+    int serial_fd;
+    struct termios tty;
 
-    fp = fopen(DB_FILE, "a+");
-    if (!fp)
+    serial_fd = open(device, O_RDWR | O_NOCTTY | O_SYNC);
+    if (serial_fd < 0)
     {
-        perror("fopen");
-        return NULL;
+        perror("open");
+        return -1;
     }
 
-    fseek(fp, 0, SEEK_END);
-    fileSize = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-
-    if (fileSize == 0)
+    if (tcgetattr(serial_fd, &tty) != 0)
     {
-        return NULL;
+        perror("tcgetattr");
+        close(serial_fd);
+        return -1;
     }
 
-    fileBuf = (char *)malloc(fileSize + 1);
-    memset(fileBuf, 0, fileSize + 1);
-    fread(fileBuf, sizeof(char), fileSize, fp);
+    cfsetospeed(&tty, B9600);
+    cfsetispeed(&tty, B9600);
 
-    pos = fileBuf;
-    tail = fileBuf + strlen(fileBuf) + 1;
-    do
+    tty.c_cflag = (tty.c_cflag & ~CSIZE) | CS8; // 8-bit chars
+    // disable IGNBRK for mismatched speed tests; otherwise receive break
+    // as \000 chars
+    tty.c_iflag &= ~IGNBRK; // disable break processing
+    tty.c_lflag = 0;        // no signaling chars, no echo,
+                            // no canonical processing
+    tty.c_oflag = 0;        // no remapping, no delays
+    tty.c_cc[VMIN] = 0;     // read doesn't block
+    tty.c_cc[VTIME] = 5;    // 0.5 seconds read timeout
+
+    tty.c_iflag &= ~(IXON | IXOFF | IXANY); // shut off xon/xoff ctrl
+
+    tty.c_cflag |= (CLOCAL | CREAD);   // ignore modem controls,
+                                       // enable reading
+    tty.c_cflag &= ~(PARENB | PARODD); // shut off parity
+    tty.c_cflag &= ~CSTOPB;
+    tty.c_cflag &= ~CRTSCTS;
+
+    if (tcsetattr(serial_fd, TCSANOW, &tty) != 0)
     {
-        memcpy(tagBuf, pos, 12);
-        if (strcmp(tagBuf, tagToCheck) == 0)
-        {
-            nextPos = strchr(pos, '\n');
-            nextPos++;
-            retSize = (nextPos - pos) + 1;
-            retBuf = (char *)malloc(retSize);
-            memset(retBuf, 0, retSize);
-            memcpy(retBuf, pos, retSize - 1);
-            free(fileBuf);
-            fclose(fp);
-            return retBuf;
-        }
-        pos = strchr(pos, '\n');
-        pos++;
-    } while (pos < tail && *pos != 0);
-    free(fileBuf);
-    fclose(fp);
-    return NULL;
+        perror("tcsetattr");
+        close(serial_fd);
+        return -1;
+    }
+    return serial_fd;
 }
 
-bool deleteTag(char *tagToCheck)
+/*
+ * Namespaces naming the same device share one fd. A reader that can't be
+ * opened only takes its own namespaces offline; returns false if no
+ * namespace is left to serve.
+ */
+bool openReaders()
 {
-    long fileSize;
-    char *fileBuf = NULL;
-    int dataLen, tempLen;
-    char tagBuf[13];
-    char *tail, *pos, *temp;
+    struct tagDB *ns, *other;
+    bool anyAvailable = false;
 
-    memset(tagBuf, 0, sizeof(tagBuf));
+    for (ns = namespaces; ns != NULL; ns = ns->next)
+    {
+        if (!ns->available)
+        {
+            continue;
+        }
+        for (other = namespaces; other != ns; other = other->next)
+        {
+            if (other->serial_fd >= 0 && strcmp(other->reader, ns->reader) == 0)
+            {
+                ns->serial_fd = other->serial_fd;
+                break;
+            }
+        }
+        if (other == ns)
+        {
+            ns->serial_fd = openReader(ns->reader);
+            if (ns->serial_fd < 0)
+            {
+                syslog(LOG_ERR, "Namespace %s unavailable: cannot open reader %s", ns->name, ns->reader);
+                ns->available = false;
+                continue;
+            }
+        }
+        anyAvailable = true;
+    }
 
-    fp = fopen(DB_FILE, "a+");
-    if (!fp)
+    if (!anyAvailable)
     {
-        perror("fopen");
         return false;
     }
 
-    fseek(fp, 0, SEEK_END);
-    fileSize = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    if (fileSize == 0)
+    for (ns = namespaces, readerCount = 0; ns != NULL; ns = ns->next)
     {
-        return NULL;
+        readerCount++;
+    }
+    readerFds = (struct pollfd *)calloc(readerCount, sizeof(*readerFds));
+    if (readerFds == NULL)
+    {
+        perror("calloc");
+        return false;
+    }
+    readerCount = 0;
+    for (ns = namespaces; ns != NULL; ns = ns->next)
+    {
+        for (other = namespaces; other != ns; other = other->next)
+        {
+            if (other->serial_fd == ns->serial_fd)
+            {
+                break;
+            }
+        }
+        if (other == ns && ns->serial_fd >= 0)
+        {
+            readerFds[readerCount].fd = ns->serial_fd;
+            readerFds[readerCount].events = POLLIN;
+            readerCount++;
+        }
     }
+    return true;
+}
 
-    fileBuf = (char *)malloc(fileSize + 1);
-    memset(fileBuf, 0, fileSize + 1);
-    fread(fileBuf, sizeof(char), fileSize, fp);
+void closeReaders()
+{
+    struct tagDB *ns, *other;
 
-    pos = fileBuf;
-    tail = fileBuf + strlen(fileBuf) + 1;
-    dataLen = strlen(fileBuf);
-    do
+    for (ns = namespaces; ns != NULL; ns = ns->next)
     {
-        memcpy(tagBuf, pos, 12);
-        if (strcmp(tagBuf, tagToCheck) == 0)
+        for (other = namespaces; other != ns; other = other->next)
         {
-            temp = strchr(pos, '\n');
-            tempLen = strlen(temp + 1);
-            memcpy(pos, temp + 1, tempLen);
-            fclose(fp);
-            remove("/var/lib/securitySystem/tagDB");
-            fp = fopen("/var/lib/securitySystem/tagDB", "a+");
-            if ((size_t)dataLen - (size_t)(temp - pos + 1) == 0)
+            if (other->serial_fd == ns->serial_fd)
             {
-                return false;
+                break;
             }
-            fwrite(fileBuf, sizeof(char), (size_t)dataLen - (size_t)(temp - pos + 1), fp);
-            free(fileBuf);
-            fclose(fp);
-            return true;
         }
-        pos = strchr(pos, '\n');
-        pos++;
-    } while (pos < tail);
-    free(fileBuf);
-    fclose(fp);
-    return false;
+        if (other == ns && ns->serial_fd >= 0)
+        {
+            close(ns->serial_fd);
+        }
+    }
+    free(readerFds);
+    readerFds = NULL;
+    readerCount = 0;
 }
 
-bool modifyTag(char *tagToCheck, char *newData)
+/*
+ * Checks a scan from the reader on serial_fd against every namespace mapped
+ * to it. The decision comes from the resident tag indexes; only the client's
+ * own namespace is asked for the tag's details, so a shared reader never
+ * pages in more than that one.
+ */
+static void handleScan(int serial_fd, char *tag, int conn_fd, struct tagDB *connNs)
 {
-    long fileSize;
-    char *fileBuf = NULL;
-    int dataLen, tempLen;
-    char tagBuf[13];
-    char *tail, *pos, *temp;
+    struct tagDB *ns;
+    char *retBuf = NULL;
+    bool granted = false;
+    bool report = conn_fd >= 0 && connNs != NULL && connNs->serial_fd == serial_fd;
+
+    for (ns = namespaces; ns != NULL && !granted; ns = ns->next)
+    {
+        if (ns->available && ns->serial_fd == serial_fd)
+        {
+            granted = verifyAccess(ns, tag, report && ns == connNs ? &retBuf : NULL);
+            if (granted)
+            {
+                countScan(ns, true);
+                syslog(LOG_DEBUG, "Access granted to %s in namespace %s", tag, ns->name);
+            }
+        }
+    }
 
-    memset(tagBuf, 0, sizeof(tagBuf));
+    if (!granted)
+    {
+        for (ns = namespaces; ns != NULL; ns = ns->next)
+        {
+            if (ns->available && ns->serial_fd == serial_fd)
+            {
+                countScan(ns, false);
+            }
+        }
+        syslog(LOG_DEBUG, "Access denied to %s", tag);
+        if (report)
+        {
+            char temp[] = "Access Denied.\n";
+            write(conn_fd, temp, strlen(temp));
+        }
+        return;
+    }
 
-    fp = fopen(DB_FILE, "a+");
-    if (!fp)
+    if (report)
     {
-        perror("fopen");
-        return false;
+        char temp[] = "Access Granted. Welcome!\n";
+        write(conn_fd, temp, strlen(temp));
+        if (retBuf)
+        {
+            char temp2[] = "Data: ";
+            char temp3[] = "Last Modified: ";
+
+            char *firstPos = strchr(retBuf, ',') + 1;
+            char *secondPos = strchr(firstPos, ',') + 1;
+            *(secondPos - 1) = '\n';
+
+            write(conn_fd, temp2, sizeof(temp2));
+            write(conn_fd, firstPos, (size_t)(secondPos - firstPos));
+            write(conn_fd, temp3, sizeof(temp3));
+            write(conn_fd, secondPos, strlen(secondPos));
+        }
     }
+    free(retBuf);
+}
+
+// Takes every namespace served by a failed reader offline
+static void dropReader(int serial_fd)
+{
+    struct tagDB *ns;
 
-    fseek(fp, 0, SEEK_END);
-    fileSize = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    if (fileSize == 0)
+    pthread_mutex_lock(&storage.lock);
+    for (ns = namespaces; ns != NULL; ns = ns->next)
     {
-        return NULL;
+        if (ns->available && ns->serial_fd == serial_fd)
+        {
+            ns->available = false;
+            syslog(LOG_ERR, "Namespace %s unavailable: lost reader %s", ns->name, ns->reader);
+        }
     }
+    pthread_mutex_unlock(&storage.lock);
+}
 
-    fileBuf = (char *)malloc(fileSize + 1);
-    memset(fileBuf, 0, fileSize + 1);
-    fread(fileBuf, sizeof(char), fileSize, fp);
+/*
+ * Waits up to timeout_ms for scans on any reader and checks each one. While
+ * an admin command is waiting for a tag, a scan on enrolNs's reader is
+ * copied to enrolBuf instead; returns true once that happens.
+ */
+bool serviceReaders(int timeout_ms, int conn_fd, struct tagDB *connNs,
+                    struct tagDB *enrolNs, char *enrolBuf)
+{
+    char tagBuf[16];
+    bool enrolled = false;
+    nfds_t i;
 
-    pos = fileBuf;
-    tail = fileBuf + strlen(fileBuf) + 1;
-    dataLen = strlen(fileBuf);
-    do
+    if (poll(readerFds, readerCount, timeout_ms) <= 0)
     {
-        memcpy(tagBuf, pos, 12);
-        if (strcmp(tagBuf, tagToCheck) == 0)
+        return false;
+    }
+
+    for (i = 0; i < readerCount; i++)
+    {
+        if (readerFds[i].revents & (POLLERR | POLLHUP | POLLNVAL))
         {
-            temp = strchr(pos, '\n');
-            tempLen = strlen(temp + 1);
-            memcpy(pos, temp + 1, tempLen);
-            fclose(fp);
-            remove("/var/lib/securitySystem/tagDB");
-            fp = fopen("/var/lib/securitySystem/tagDB", "a+");
-            if ((size_t)dataLen - (size_t)(temp - pos + 1) != 0)
-            {
-                fwrite(fileBuf, sizeof(char), (size_t)dataLen - (size_t)(temp - pos + 1), fp);
-            }
-            tagBuf[12] = ',';
-            fwrite(tagBuf, sizeof(char), 13, fp);
-            fwrite(newData, sizeof(char), strlen(newData), fp);
-            writeCurrentTime(fp);
-            free(fileBuf);
-            fclose(fp);
-            return true;
+            // A negative fd makes poll() skip the reader from now on
+            syslog(LOG_ERR, "Reader on fd %d failed, no longer polling it", readerFds[i].fd);
+            dropReader(readerFds[i].fd);
+            readerFds[i].fd = -1;
+            continue;
         }
-        pos = strchr(pos, '\n');
-        pos++;
-    } while (pos < tail);
-    free(fileBuf);
-    fclose(fp);
-    return false;
+        if (!(readerFds[i].revents & POLLIN))
+        {
+            continue;
+        }
+
+        memset(tagBuf, 0, sizeof(tagBuf));
+        if (readBytesFromSerial(readerFds[i].fd, tagBuf, sizeof(tagBuf)) <= 0)
+        {
+            continue;
+        }
+        tagBuf[13] = 0;
+        if (enrolBuf != NULL && !enrolled && readerFds[i].fd == enrolNs->serial_fd)
+        {
+            memcpy(enrolBuf, tagBuf, sizeof(tagBuf));
+            enrolled = true;
+            continue;
+        }
+        handleScan(readerFds[i].fd, tagBuf + 1, conn_fd, connNs);
+    }
+    return enrolled;
+}
+
+// Keeps doors and replies serviced while the storage thread pages ns back in
+void waitResident(struct tagDB *ns, int conn_fd)
+{
+    while (exitRequested == 0 && !isResident(ns))
+    {
+        requestResident(ns);
+        serviceReaders(READER_POLL_MS, conn_fd, ns, NULL, NULL);
+        sendCompletedReplies();
+    }
 }
 
 int main(int argc, char *argv[])
@@ -306,9 +1634,9 @@ int main(int argc, char *argv[])
     socklen_t client_size;
     bool useDaemon;
     pid_t pid;
-    int serial_fd;
     char tagBuf[16];
-    int retval;
+    struct tagDB *ns;
+    char statsBuf[512];
 
     struct timeval ts;
     ts.tv_sec = 0;
@@ -317,7 +1645,6 @@ int main(int argc, char *argv[])
     char *cmdBuffer = NULL;
     int cmdBufferLen = START_LEN;
     int ret;
-    char *retBuf;
 
     if (argc == 2)
     {
@@ -350,6 +1677,13 @@ int main(int argc, char *argv[])
         printf("Couldn't handle SIGTERM");
         exit(-1);
     }
+    // Deferred replies can land after the client hung up
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+    {
+        perror("signal");
+        printf("Couldn't ignore SIGPIPE");
+        exit(-1);
+    }
 
     socket_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (socket_fd == -1)
@@ -410,47 +1744,23 @@ int main(int argc, char *argv[])
         exit(-1);
     }
 
-    serial_fd = open("/dev/ttyUSB0", O_RDWR | O_NOCTTY | O_SYNC);
-    if (serial_fd < 0)
+    if (!loadNamespaces())
     {
-        perror("open");
-        printf("Failed to open serial device\n");
+        printf("Failed to load tag DB namespaces\n");
         exit(-1);
     }
 
-    struct termios tty;
-    if (tcgetattr(serial_fd, &tty) != 0)
+    if (!openReaders())
     {
-        perror("tcgetattr");
-        close(serial_fd);
-        return -1;
+        printf("No namespace has a usable tag DB and reader\n");
+        closeReaders();
+        exit(-1);
     }
 
-    cfsetospeed(&tty, B9600);
-    cfsetispeed(&tty, B9600);
-
-    tty.c_cflag = (tty.c_cflag & ~CSIZE) | CS8; // 8-bit chars
-    // disable IGNBRK for mismatched speed tests; otherwise receive break
-    // as \000 chars
-    tty.c_iflag &= ~IGNBRK; // disable break processing
-    tty.c_lflag = 0;        // no signaling chars, no echo,
-                            // no canonical processing
-    tty.c_oflag = 0;        // no remapping, no delays
-    tty.c_cc[VMIN] = 0;     // read doesn't block
-    tty.c_cc[VTIME] = 5;    // 0.5 seconds read timeout
-
-    tty.c_iflag &= ~(IXON | IXOFF | IXANY); // shut off xon/xoff ctrl
-
-    tty.c_cflag |= (CLOCAL | CREAD);   // ignore modem controls,
-                                       // enable reading
-    tty.c_cflag &= ~(PARENB | PARODD); // shut off parity
-    tty.c_cflag &= ~CSTOPB;
-    tty.c_cflag &= ~CRTSCTS;
-
-    if (tcsetattr(serial_fd, TCSANOW, &tty) != 0)
+    if (!startStorage())
     {
-        perror("tcsetattr");
-        close(serial_fd);
+        printf("Failed to start storage thread\n");
+        closeReaders();
         exit(-1);
     }
 
@@ -462,16 +1772,27 @@ int main(int argc, char *argv[])
         {
             if (errno == EAGAIN || errno == EWOULDBLOCK)
             {
+                serviceReaders(READER_POLL_MS, -1, NULL, NULL, NULL);
+                sendCompletedReplies();
                 continue;
             }
             perror("accept");
             printf("Accept failed\n");
-            close(serial_fd);
+            closeReaders();
+            stopStorage();
             exit(-1);
         }
 
         inet_ntop(AF_INET, &(client.sin_addr), client_str, INET_ADDRSTRLEN);
         syslog(LOG_DEBUG, "Accepted connection from %s", client_str);
+        ns = defaultNamespace();
+        if (ns == NULL)
+        {
+            char temp[] = "No namespace available.\n";
+            write(conn_fd, temp, strlen(temp));
+            close(conn_fd);
+            continue;
+        }
 
         cmdBufferLen = START_LEN;
         cmdBuffer = (char *)malloc(sizeof(char) * cmdBufferLen);
@@ -479,7 +1800,8 @@ int main(int argc, char *argv[])
         {
             perror("malloc");
             printf("buffer malloc failed\n");
-            close(serial_fd);
+            closeReaders();
+            stopStorage();
             exit(-1);
         }
 
@@ -487,59 +1809,26 @@ int main(int argc, char *argv[])
         {
             memset(cmdBuffer, 0, cmdBufferLen);
             ret = readFromSocket(conn_fd, cmdBuffer, cmdBufferLen);
+            if (ret == -2)
+            {
+                dropReplies(conn_fd);
+                close(conn_fd);
+                free(cmdBuffer);
+                break;
+            }
+            sendCompletedReplies();
             if (ret == 0)
             {
-                memset(tagBuf, 0, sizeof(tagBuf));
-                retval = readBytesFromSerial(serial_fd, tagBuf, sizeof(tagBuf));
-                if (retval > 0)
-                {
-                    tagBuf[13] = 0;
-                    retBuf = verifyAccess(tagBuf + 1);
-                    if (retBuf)
-                    {
-                        char temp[] = "Access Granted. Welcome!\n";
-                        write(conn_fd, temp, strlen(temp));
-                        char temp2[] = "Data: ";
-                        char temp3[] = "Last Modified: ";
-
-                        char *firstPos = strchr(retBuf, ',') + 1;
-                        char *secondPos = strchr(firstPos, ',') + 1;
-                        *(secondPos - 1) = '\n';
-
-                        fp = fopen(DB_FILE, "a+");
-                        if (!fp)
-                        {
-                            perror("fopen");
-                            close(serial_fd);
-                            close(conn_fd);
-                            exit(-1);
-                        }
-                        write(conn_fd, temp2, sizeof(temp2));
-                        write(conn_fd, firstPos, (size_t)(secondPos - firstPos));
-                        write(conn_fd, temp3, sizeof(temp3));
-                        write(conn_fd, secondPos, strlen(secondPos));
-                        fclose(fp);
-                        free(retBuf);
-                    }
-                    else
-                    {
-                        char temp[] = "Access Denied.\n";
-                        write(conn_fd, temp, strlen(temp));
-                    }
-                }
+                serviceReaders(0, conn_fd, ns, NULL, NULL);
                 continue;
             }
             else if (ret == -1)
             {
                 free(cmdBuffer);
-                close(serial_fd);
-                fclose(fp);
+                closeReaders();
+                stopStorage();
                 exit(-1);
             }
-            else if (ret == -2)
-            {
-                break;
-            }
             else
             {
                 cmdBufferLen = ret;
@@ -547,16 +1836,22 @@ int main(int argc, char *argv[])
                 {
                     char temp[] = "Scan tag to add.\n";
                     write(conn_fd, temp, strlen(temp));
+                    requestResident(ns);
                     memset(tagBuf, 0, 16);
-                    while (exitRequested == 0 && strlen(tagBuf) == 0)
+                    while (exitRequested == 0 && ns->available &&
+                           !serviceReaders(READER_POLL_MS, conn_fd, ns, ns, tagBuf))
                     {
-                        retval = readBytesFromSerial(serial_fd, tagBuf, sizeof(tagBuf));
+                        sendCompletedReplies();
+                    }
+                    if (strlen(tagBuf) == 0 && !ns->available)
+                    {
+                        char temp2[] = "Reader unavailable.\n";
+                        write(conn_fd, temp2, strlen(temp2));
                     }
                     if (strlen(tagBuf) != 0)
                     {
                         tagBuf[13] = 0;
-                        retBuf = verifyAccess(tagBuf + 1);
-                        if (!retBuf)
+                        if (!verifyAccess(ns, tagBuf + 1, NULL))
                         {
                             char temp2[] = "Enter Name:\n";
                             write(conn_fd, temp2, strlen(temp2));
@@ -569,29 +1864,18 @@ int main(int argc, char *argv[])
                                 {
                                     break;
                                 }
+                                serviceReaders(0, conn_fd, ns, NULL, NULL);
+                                sendCompletedReplies();
                             } while (ret == 0);
-                            tagBuf[13] = ',';
                             *(nameBuffer + strlen(nameBuffer) - 1) = ',';
-                            fp = fopen(DB_FILE, "a+");
-                            if (!fp)
-                            {
-                                perror("fopen");
-                                close(serial_fd);
-                                close(conn_fd);
-                                exit(-1);
-                            }
-                            fseek(fp, 0, SEEK_END);
-                            fwrite(tagBuf + 1, sizeof(char), 13, fp);
-                            fwrite(nameBuffer, sizeof(char), strlen(nameBuffer), fp);
-                            writeCurrentTime(fp);
-                            fclose(fp);
-                            char temp3[] = "New tag added successfully.\n";
-                            write(conn_fd, temp3, strlen(temp3));
+                            waitResident(ns, conn_fd);
+                            deferReply(addTag(ns, tagBuf + 1, nameBuffer), conn_fd,
+                                       "New tag added successfully.\n",
+                                       "Failed to save new tag.\n");
                             free(nameBuffer);
                         }
                         else
                         {
-                            free(retBuf);
                             char temp2[] = "Tag already in system. Use MODIFY to edit an existing tag.\n";
                             write(conn_fd, temp2, strlen(temp2));
                         }
@@ -601,21 +1885,27 @@ int main(int argc, char *argv[])
                 {
                     char temp[] = "Scan tag to delete.\n";
                     write(conn_fd, temp, strlen(temp));
+                    requestResident(ns);
                     memset(tagBuf, 0, 16);
-                    while (exitRequested == 0 && strlen(tagBuf) == 0)
+                    while (exitRequested == 0 && ns->available &&
+                           !serviceReaders(READER_POLL_MS, conn_fd, ns, ns, tagBuf))
+                    {
+                        sendCompletedReplies();
+                    }
+                    if (strlen(tagBuf) == 0 && !ns->available)
                     {
-                        retval = readBytesFromSerial(serial_fd, tagBuf, sizeof(tagBuf));
+                        char temp2[] = "Reader unavailable.\n";
+                        write(conn_fd, temp2, strlen(temp2));
                     }
                     if (strlen(tagBuf) != 0)
                     {
                         tagBuf[13] = 0;
-                        retBuf = verifyAccess(tagBuf + 1);
-                        if (retBuf)
+                        if (verifyAccess(ns, tagBuf + 1, NULL))
                         {
-                            free(retBuf);
-                            deleteTag(tagBuf + 1);
-                            char temp2[] = "Tag successfully Deleted.\n";
-                            write(conn_fd, temp2, strlen(temp2));
+                            waitResident(ns, conn_fd);
+                            deferReply(deleteTag(ns, tagBuf + 1), conn_fd,
+                                       "Tag successfully Deleted.\n",
+                                       "Failed to delete tag.\n");
                         }
                         else
                         {
@@ -628,16 +1918,22 @@ int main(int argc, char *argv[])
                 {
                     char temp[] = "Scan tag to modify.\n";
                     write(conn_fd, temp, strlen(temp));
+                    requestResident(ns);
                     memset(tagBuf, 0, 16);
-                    while (exitRequested == 0 && strlen(tagBuf) == 0)
+                    while (exitRequested == 0 && ns->available &&
+                           !serviceReaders(READER_POLL_MS, conn_fd, ns, ns, tagBuf))
+                    {
+                        sendCompletedReplies();
+                    }
+                    if (strlen(tagBuf) == 0 && !ns->available)
                     {
-                        retval = readBytesFromSerial(serial_fd, tagBuf, sizeof(tagBuf));
+                        char temp2[] = "Reader unavailable.\n";
+                        write(conn_fd, temp2, strlen(temp2));
                     }
                     if (strlen(tagBuf) != 0)
                     {
                         tagBuf[13] = 0;
-                        retBuf = verifyAccess(tagBuf + 1);
-                        if (retBuf)
+                        if (verifyAccess(ns, tagBuf + 1, NULL))
                         {
                             char temp2[] = "Enter New Name:\n";
                             write(conn_fd, temp2, strlen(temp2));
@@ -650,31 +1946,52 @@ int main(int argc, char *argv[])
                                 {
                                     break;
                                 }
+                                serviceReaders(0, conn_fd, ns, NULL, NULL);
+                                sendCompletedReplies();
                             } while (ret == 0);
                             *(nameBuffer + strlen(nameBuffer) - 1) = ',';
-                            modifyTag(tagBuf + 1, nameBuffer);
-                            fp = fopen(DB_FILE, "a+");
-                            if (!fp)
-                            {
-                                perror("fopen");
-                                close(serial_fd);
-                                close(conn_fd);
-                                exit(-1);
-                            }
-
-                            fclose(fp);
-                            char temp3[] = "Existing tag modified successfully.\n";
-                            write(conn_fd, temp3, strlen(temp3));
+                            waitResident(ns, conn_fd);
+                            deferReply(modifyTag(ns, tagBuf + 1, nameBuffer), conn_fd,
+                                       "Existing tag modified successfully.\n",
+                                       "Failed to modify tag.\n");
                             free(nameBuffer);
                         }
                         else
                         {
-                            free(retBuf);
                             char temp2[] = "Tag not in system. Use ADD for a new tag.\n";
                             write(conn_fd, temp2, strlen(temp2));
                         }
                     }
                 }
+                else if (strncmp(cmdBuffer, "NS ", 3) == 0)
+                {
+                    struct tagDB *selected;
+
+                    *strchr(cmdBuffer, '\n') = 0;
+                    selected = findNamespace(cmdBuffer + 3);
+                    if (selected && !selected->available)
+                    {
+                        char temp[] = "Namespace unavailable.\n";
+                        write(conn_fd, temp, strlen(temp));
+                    }
+                    else if (selected)
+                    {
+                        ns = selected;
+                        requestResident(ns);
+                        char temp[] = "Namespace selected.\n";
+                        write(conn_fd, temp, strlen(temp));
+                    }
+                    else
+                    {
+                        char temp[] = "Unknown namespace.\n";
+                        write(conn_fd, temp, strlen(temp));
+                    }
+                }
+                else if (strcmp(cmdBuffer, "STATS\n") == 0)
+                {
+                    formatStats(ns, statsBuf, sizeof(statsBuf));
+                    write(conn_fd, statsBuf, strlen(statsBuf));
+                }
                 else
                 {
                     char temp[] = "Unrecognized command\n";
@@ -684,5 +2001,7 @@ int main(int argc, char *argv[])
         }
     }
     close(socket_fd);
-    close(serial_fd);
+    closeReaders();
+    stopStorage();
+    sendCompletedReplies();
 }
\ No newline at end of file